@@ -25,6 +25,16 @@ Author: Nimish Bhide (University of Colorado, Boulder)
 #include <ctype.h>
 #include <errno.h>
 #include<signal.h>
+#include <stdint.h>
+#include <time.h>
+
+// USDT probes are compiled in when the systemtap SDT header is available.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT (1)
+#endif
+#endif
 
 
 #define BUFF_SIZE (4096)        
@@ -35,8 +45,41 @@ Author: Nimish Bhide (University of Colorado, Boulder)
 #define MAX_FILEPATH_LENGTH (1024)
 #define DEFAULT_PATH "./www"
 #define DEFAULT_OBJECT "/index.html"
+#define DEF_SLOW_REQ_MS (100)       /* Slow request threshold default value */
+#define SLOW_REQ_LOG "./slow_requests.log"
+
+#ifdef HAVE_SDT
+#define WEBSERVER_PROBE3(name, a, b, c) DTRACE_PROBE3(webserver, name, a, b, c)
+#define WEBSERVER_PROBE4(name, a, b, c, d) DTRACE_PROBE4(webserver, name, a, b, c, d)
+#else
+#define WEBSERVER_PROBE3(name, a, b, c) do {} while (0)
+#define WEBSERVER_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+// Request phases, in the order they happen.
+enum req_phase
+{
+    PHASE_RECV,
+    PHASE_PARSE,
+    PHASE_LOOKUP,
+    PHASE_READ,
+    PHASE_SEND,
+    PHASE_COUNT
+};
+
+const char *phase_names[PHASE_COUNT] = {"recv", "parse", "lookup", "read", "send"};
+
+// Per-request phase timings, kept on the connection thread's stack.
+struct req_trace
+{
+    int fd;
+    uint64_t last_ns;                   /* Timestamp of the previous phase boundary */
+    uint64_t phase_ns[PHASE_COUNT];     /* Time spent in each phase */
+};
 
 int server_socket;                  /* Stores server socket file descriptor */
+long slow_req_ms = DEF_SLOW_REQ_MS; /* Requests slower than this are logged */
+FILE *slow_log;                     /* Slow request log; NULL if it could not be opened */
 
 int check(int n, char* err);
 static void sig_handler(int signo);
@@ -45,9 +88,13 @@ const char *get_ext(const char *fspec);
 char *str_to_lower_case(char *str);
 int is_valid_path(char *actual_file_path);
 void *handle_new_connection(void *vargp);
-int handle_http_head_request(char *file_uri, ssize_t *file_len, char *file_type);
-char *handle_http_get_request(char *file_uri, ssize_t *file_len, char *file_type);
-char *handle_http_post_request(char *file_uri, ssize_t *file_len, char *file_type, char *post_data);
+int handle_http_head_request(char *file_uri, ssize_t *file_len, char *file_type, struct req_trace *trace);
+char *handle_http_get_request(char *file_uri, ssize_t *file_len, char *file_type, struct req_trace *trace);
+char *handle_http_post_request(char *file_uri, ssize_t *file_len, char *file_type, char *post_data, struct req_trace *trace);
+static uint64_t mono_ns(void);
+static void trace_begin(struct req_trace *trace, int fd);
+static void trace_mark(struct req_trace *trace, enum req_phase phase);
+static void trace_end_request(struct req_trace *trace, char *method, char *uri);
 void build_http_ok_response(char *resp_msg, char *version, ssize_t filesize, char *filetype, int conn_stat, char *buff);
 void build_http_err_response(char *err_msg, char *version, int errsize, int conn_stat, char *buff);
 
@@ -117,6 +164,82 @@ char *get_content_type(char *path)
 }
 
 
+/*
+Returns the current time of the monotonic clock
+in nanoseconds.
+*/
+static uint64_t mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+Resets the phase timings and starts the clock
+for the next request on a connection.
+*/
+static void trace_begin(struct req_trace *trace, int fd)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->fd = fd;
+    trace->last_ns = mono_ns();
+}
+
+
+/*
+Closes the given phase: charges the time since the
+previous boundary to it and fires the phase probe.
+*/
+static void trace_mark(struct req_trace *trace, enum req_phase phase)
+{
+    uint64_t now = mono_ns();
+    uint64_t elapsed = now - trace->last_ns;
+    trace->phase_ns[phase] += elapsed;
+    trace->last_ns = now;
+    WEBSERVER_PROBE4(phase, trace->fd, (int)phase, phase_names[phase], elapsed);
+}
+
+
+/*
+Closes the send phase and writes the request to the
+slow request log if it exceeded the threshold, then
+re-arms the trace for the next request on the connection.
+The recv phase includes keep-alive idle time, so it is
+logged but not counted towards the threshold.
+*/
+static void trace_end_request(struct req_trace *trace, char *method, char *uri)
+{
+    trace_mark(trace, PHASE_SEND);
+
+    uint64_t service_ns = 0;
+    for (int i = PHASE_PARSE; i < PHASE_COUNT; i++)
+    {
+        service_ns += trace->phase_ns[i];
+    }
+    int slow = service_ns >= (uint64_t)slow_req_ms * 1000000ULL;
+    WEBSERVER_PROBE3(request__done, trace->fd, service_ns, slow);
+
+    if (slow && slow_log != NULL)
+    {
+        // A single fprintf keeps lines from different threads intact.
+        fprintf(slow_log, "%ld %s %s total=%.3fms recv=%.3fms parse=%.3fms lookup=%.3fms read=%.3fms send=%.3fms\n",
+                (long)time(NULL),
+                method,
+                uri,
+                service_ns / 1e6,
+                trace->phase_ns[PHASE_RECV] / 1e6,
+                trace->phase_ns[PHASE_PARSE] / 1e6,
+                trace->phase_ns[PHASE_LOOKUP] / 1e6,
+                trace->phase_ns[PHASE_READ] / 1e6,
+                trace->phase_ns[PHASE_SEND] / 1e6);
+        fflush(slow_log);
+    }
+    trace_begin(trace, trace->fd);
+}
+
+
 // Guard function to look for failures.
 int check(int n, char* err)
 {
@@ -208,7 +331,7 @@ Handles HTTP HEAD request.
 Return -> 1 if file is valid; 
           0 if not.
 */
-int handle_http_head_request(char *file_uri, ssize_t *file_len, char *file_type)
+int handle_http_head_request(char *file_uri, ssize_t *file_len, char *file_type, struct req_trace *trace)
 {   
     struct stat st;
     
@@ -231,11 +354,13 @@ int handle_http_head_request(char *file_uri, ssize_t *file_len, char *file_type)
         stat(path, &st);
         *(file_len) = st.st_size;
         strcpy(file_type, get_content_type(path));
+        trace_mark(trace, PHASE_LOOKUP);
         return 1;
     }
     else
     {
         // return error response.
+        trace_mark(trace, PHASE_LOOKUP);
         *(file_len) = 0;
         file_type = NULL;
         return 0;
@@ -248,7 +373,7 @@ Handles HTTP GET request.
 Return -> string buff containing file if file exists.
           NULL if file does not exist.
 */
-char *handle_http_get_request(char *file_uri, ssize_t *file_len, char *file_type)
+char *handle_http_get_request(char *file_uri, ssize_t *file_len, char *file_type, struct req_trace *trace)
 {
     printf("Came to the get req handler.\n");
     struct stat st;
@@ -274,14 +399,17 @@ char *handle_http_get_request(char *file_uri, ssize_t *file_len, char *file_type
         *(file_len) = st.st_size;
         char *buf = (char *)malloc(sizeof(char)*(st.st_size));
         strcpy(file_type, get_content_type(path));
+        trace_mark(trace, PHASE_LOOKUP);
         FILE *file_ptr;
         file_ptr = fopen(path, "rb");
         fread(buf, 1, *(file_len), file_ptr);
+        trace_mark(trace, PHASE_READ);
         return buf;
     }
     else
     {
         // return error response.
+        trace_mark(trace, PHASE_LOOKUP);
         *(file_len) = 0;
         file_type = NULL;
         return NULL;
@@ -294,7 +422,7 @@ Handles HTTP POST request.
 Return -> string buff containing file if file exists.
           NULL if file does not exist.
 */
-char *handle_http_post_request(char *file_uri, ssize_t *file_len, char *file_type, char *post_data)
+char *handle_http_post_request(char *file_uri, ssize_t *file_len, char *file_type, char *post_data, struct req_trace *trace)
 {
     printf("Came to the post req handler.\n");
     struct stat st;
@@ -318,6 +446,7 @@ char *handle_http_post_request(char *file_uri, ssize_t *file_len, char *file_typ
         stat(path, &st);
         char *buf = (char *)malloc(sizeof(char)*(st.st_size));
         strcpy(file_type, get_content_type(path));
+        trace_mark(trace, PHASE_LOOKUP);
         FILE *file_ptr;
         file_ptr = fopen(path, "rb");
         fread(buf, 1, st.st_size, file_ptr);
@@ -328,11 +457,13 @@ char *handle_http_post_request(char *file_uri, ssize_t *file_len, char *file_typ
         sprintf(post_html, "<html><body><pre><h1>%s</h1></pre>%s", post_data, buf);
         *(file_len) = strlen(post_html);
         free(buf);
+        trace_mark(trace, PHASE_READ);
         return post_html;
     }
     else
     {
         // return error response.
+        trace_mark(trace, PHASE_LOOKUP);
         *(file_len) = 0;
         file_type = NULL;
         return NULL;
@@ -348,14 +479,22 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
 
     // Check for invalid input from CLI.
-    if ((argc != 2) || (atoi(argv[1]) < 5000))
+    if ((argc != 2 && argc != 3) || (atoi(argv[1]) < 5000) || (argc == 3 && atol(argv[2]) < 0))
     {   
         // Print out error message explaining correct way to input.
         printf("Invalid input/port.\n");
-        printf("Usage --> ./[%s] [Port Number]\n", argv[0]);
+        printf("Usage --> ./[%s] [Port Number] [Slow Request ms]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
+    // Optional slow request threshold.
+    if (argc == 3)
+        slow_req_ms = atol(argv[2]);
+
+    // Open the slow request log. The server keeps running without it.
+    if ((slow_log = fopen(SLOW_REQ_LOG, "a")) == NULL)
+        perror("could not open slow request log");
+
     int srv_port = atoi(argv[1]);           // Store server port received in input.
     struct sockaddr_in srv_addr;            // Server address.
     int srv_addrlen = sizeof(srv_addr);     // Server address length.
@@ -415,12 +554,16 @@ void *handle_new_connection(void *vargp)
     char *keep_alive_str = "keep-alive";
     char *conn_close_str = "close";
     char *error_msg = "<!DOCTYPE html><html><title>Invalid Request</title>""<pre><h1>500 Internal Server Error</h1></pre>""</html>\r\n";
+    struct req_trace trace;
     memset(recv_buffer, 0, sizeof(recv_buffer));
+    trace_begin(&trace, client_socket);
 
     while ((bytes_read = recv(client_socket, recv_buffer, sizeof(recv_buffer), 0)) > 0)
     {   
+        trace_mark(&trace, PHASE_RECV);
         memset(http_method, 0, sizeof(http_method));
         memset(http_version, 0, sizeof(http_version));
+        memset(filepath, 0, sizeof(filepath));
         memset(next_header_key, 0, sizeof(next_header_key));
         memset(next_header_val, 0, sizeof(next_header_val));
 
@@ -466,6 +609,7 @@ void *handle_new_connection(void *vargp)
             timeout.tv_sec = 0;
             setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(struct timeval));
         }
+        trace_mark(&trace, PHASE_PARSE);
 
         // Check for invalid http method and version.
         // if method is not head, get, or post, return error
@@ -482,12 +626,14 @@ void *handle_new_connection(void *vargp)
             {
                 build_http_err_response(error_msg, "HTTP/1.1", strlen(error_msg), 1, send_buffer);
                 send(client_socket, send_buffer, strlen(send_buffer), 0);
+                trace_end_request(&trace, http_method, filepath);
                 continue;
             }
             else
             {
                 build_http_err_response(error_msg, "HTTP/1.1", strlen(error_msg), 0, send_buffer);
                 send(client_socket, send_buffer, strlen(send_buffer), 0);
+                trace_end_request(&trace, http_method, filepath);
                 printf("Closing HTTP connection.\n");
                 close(client_socket);
                 pthread_detach(pthread_self());
@@ -507,12 +653,14 @@ void *handle_new_connection(void *vargp)
             {
                 build_http_err_response(error_msg, "HTTP/1.1", strlen(error_msg), 1, send_buffer);
                 send(client_socket, send_buffer, strlen(send_buffer), 0);
+                trace_end_request(&trace, http_method, filepath);
                 continue;
             }
             else
             {
                 build_http_err_response(error_msg, "HTTP/1.1", strlen(error_msg), 0, send_buffer);
                 send(client_socket, send_buffer, strlen(send_buffer), 0);
+                trace_end_request(&trace, http_method, filepath);
                 printf("Closing HTTP connection.\n");
                 pthread_detach(pthread_self());
                 free(vargp);
@@ -531,7 +679,7 @@ void *handle_new_connection(void *vargp)
 
             if (keep_alive == 1)
             {   
-                if (handle_http_head_request(filepath, &content_len, content_type) == 1)
+                if (handle_http_head_request(filepath, &content_len, content_type, &trace) == 1)
                 {   
                     build_http_ok_response(NULL, http_version, content_len, content_type, 1, send_buffer);
                 }
@@ -540,11 +688,12 @@ void *handle_new_connection(void *vargp)
                     build_http_err_response(error_msg, "HTTP/1.1", strlen(error_msg), 1, send_buffer);
                 }
                 send(client_socket, send_buffer, strlen(send_buffer), 0);
+                trace_end_request(&trace, http_method, filepath);
                 continue;
             }
             else
             {   
-                if (handle_http_head_request(filepath, &content_len, content_type) == 1)
+                if (handle_http_head_request(filepath, &content_len, content_type, &trace) == 1)
                 {
                     build_http_ok_response(NULL, http_version, content_len, content_type, 0, send_buffer);
                 }
@@ -553,6 +702,7 @@ void *handle_new_connection(void *vargp)
                     build_http_err_response(error_msg, "HTTP/1.1", strlen(error_msg), 0, send_buffer);
                 }
                 send(client_socket, send_buffer, strlen(send_buffer), 0);
+                trace_end_request(&trace, http_method, filepath);
                 pthread_detach(pthread_self());
                 free(vargp);
                 close(client_socket);
@@ -569,7 +719,7 @@ void *handle_new_connection(void *vargp)
             char *file_contents;
             if (keep_alive == 1)
             {   
-                if ((file_contents = handle_http_get_request(filepath, &content_len, content_type)) == NULL)
+                if ((file_contents = handle_http_get_request(filepath, &content_len, content_type, &trace)) == NULL)
                 {   
                     build_http_err_response(error_msg, "HTTP/1.1", strlen(error_msg), 1, send_buffer);
                 }
@@ -579,12 +729,13 @@ void *handle_new_connection(void *vargp)
                 }
                 send(client_socket, send_buffer, strlen(send_buffer), 0);
                 send(client_socket, file_contents, content_len, 0);
+                trace_end_request(&trace, http_method, filepath);
                 free(file_contents);
                 continue;
             }
             else
             {   
-                if ((file_contents = handle_http_get_request(filepath, &content_len, content_type)) == NULL)
+                if ((file_contents = handle_http_get_request(filepath, &content_len, content_type, &trace)) == NULL)
                 {
                     build_http_err_response(error_msg, "HTTP/1.1", strlen(error_msg), 0, send_buffer);
                 }
@@ -594,6 +745,7 @@ void *handle_new_connection(void *vargp)
                 }
                 send(client_socket, send_buffer, strlen(send_buffer), 0);
                 send(client_socket, file_contents, content_len, 0);
+                trace_end_request(&trace, http_method, filepath);
                 free(file_contents);
                 pthread_detach(pthread_self());
                 free(vargp);
@@ -612,7 +764,7 @@ void *handle_new_connection(void *vargp)
 
             if (keep_alive == 1)
             {
-                if ((post_contents = handle_http_post_request(filepath, &content_len, content_type, post_data)) == NULL)
+                if ((post_contents = handle_http_post_request(filepath, &content_len, content_type, post_data, &trace)) == NULL)
                 {
                     build_http_err_response(error_msg, "HTTP/1.1", strlen(error_msg), 1, send_buffer);
                 }
@@ -622,12 +774,13 @@ void *handle_new_connection(void *vargp)
                 }
                 send(client_socket, send_buffer, strlen(send_buffer), 0);
                 send(client_socket, post_contents, content_len, 0);
+                trace_end_request(&trace, http_method, filepath);
                 free(post_contents);
                 continue;
             }
             else
             {
-                if ((post_contents = handle_http_post_request(filepath, &content_len, content_type, post_data)) == NULL)
+                if ((post_contents = handle_http_post_request(filepath, &content_len, content_type, post_data, &trace)) == NULL)
                 {
                     build_http_err_response(error_msg, "HTTP/1.1", strlen(error_msg), 1, send_buffer);
                 }
@@ -637,6 +790,7 @@ void *handle_new_connection(void *vargp)
                 }
                 send(client_socket, send_buffer, strlen(send_buffer), 0);
                 send(client_socket, post_contents, content_len, 0);
+                trace_end_request(&trace, http_method, filepath);
                 free(post_contents);
                 pthread_detach(pthread_self());
                 free(vargp);